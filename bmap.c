@@ -19,8 +19,10 @@
 #include <inttypes.h>
 #include <limits.h>
 #include <string.h>
+#include <math.h>
 
 #include "bmap.h"
+#include "bmap_internal.h"
 
 struct bmap *
 bmap_alloc(void)
@@ -129,18 +131,184 @@ bmap_inter64_postcount_r(struct bmap * __restrict r, struct bmap * __restrict s)
 	return bmap_count_internal(r);
 }
 
-#ifdef __AVX__
-#include <immintrin.h>
+/*
+ * Like bmap_inter64_count, but don't store the result back into r.
+ * This is what we need when r is shared between queries and must not
+ * be destroyed, which is also how the batch executor below behaves.
+ */
+int
+bmap_inter64_count_nostore(struct bmap *r, struct bmap *s)
+{
+	uint64_t *d = r->bits;
+	uint64_t *d2 = s->bits;
+	int nbits = 0;
+	int i;
+
+	for (i = 0; i < NBITS / (CHAR_BIT * sizeof(*d)); i++)
+		nbits += __builtin_popcountll(d[i] & d2[i]);
+	return nbits;
+}
 
 /*
- * The lack of this instruction is hilarious.
+ * Batch executor.
+ *
+ * When many queries intersect the same hot bitmap, issuing them one by
+ * one streams the hot bitmap through the cache once per query. Instead
+ * we walk all the bitmaps one block at a time. Queries are grouped by
+ * their most shared operand (the key) so that each block of a key is
+ * pulled into the cache once and then ANDed against every query in the
+ * group while it's still hot. None of the operands are modified.
  *
- * Why are there separate instructions that do the exact same things for single and double precision, but not
- * for ints where bit operations actually make sense. It's all casts anyway. Or is it? Two versions to test if
- * double vs. single precision makes sense.
+ * At NBITS 65536 the bitmaps fit in the cache anyway and this is slower
+ * than one query at a time, see the README.
  */
-#define mm256_and_si256(v1, v2) _mm256_castpd_si256(_mm256_and_pd(_mm256_castsi256_pd(v1), _mm256_castsi256_pd(v2)))
-#define mm256_and_si256_ps(v1, v2) _mm256_castps_si256(_mm256_and_ps(_mm256_castsi256_ps(v1), _mm256_castsi256_ps(v2)))
+#define BATCH_BLOCK_WORDS 512
+
+struct batch_freq {
+	struct bmap *b;
+	int n;
+};
+
+struct batch_ent {
+	struct bmap *key;
+	struct bmap_query *q;
+};
+
+static int
+batch_ptrcmp(const void *a, const void *b)
+{
+	uintptr_t pa = (uintptr_t)*(struct bmap * const *)a;
+	uintptr_t pb = (uintptr_t)*(struct bmap * const *)b;
+
+	return pa < pb ? -1 : pa > pb;
+}
+
+static int
+batch_entcmp(const void *a, const void *b)
+{
+	return batch_ptrcmp(&((const struct batch_ent *)a)->key, &((const struct batch_ent *)b)->key);
+}
+
+static int
+batch_freq(const struct batch_freq *freq, int nfreq, struct bmap *b)
+{
+	struct batch_freq k = { b, 0 };
+	const struct batch_freq *f;
+
+	f = bsearch(&k, freq, nfreq, sizeof(*freq), batch_ptrcmp);
+	return f ? f->n : 0;
+}
+
+static void
+batch_block(const struct batch_ent *ent, int nent, int blk, int nwords)
+{
+	uint64_t acc[BATCH_BLOCK_WORDS];
+	const uint64_t *k = (uint64_t *)ent[0].key->bits + blk;
+	int i, j, o;
+
+	for (i = 0; i < nent; i++) {
+		struct bmap_query *q = ent[i].q;
+		int nbits = 0;
+
+		if (q->nops == 1) {
+			for (j = 0; j < nwords; j++)
+				nbits += __builtin_popcountll(k[j]);
+		} else if (q->nops == 2) {
+			struct bmap *other = q->ops[0] == ent[i].key ? q->ops[1] : q->ops[0];
+			const uint64_t *d = (uint64_t *)other->bits + blk;
+
+			for (j = 0; j < nwords; j++)
+				nbits += __builtin_popcountll(k[j] & d[j]);
+		} else {
+			memcpy(acc, k, nwords * sizeof(*acc));
+			for (o = 0; o < q->nops; o++) {
+				const uint64_t *d = (uint64_t *)q->ops[o]->bits + blk;
+
+				if (q->ops[o] == ent[i].key)
+					continue;
+				for (j = 0; j < nwords; j++)
+					acc[j] &= d[j];
+			}
+			for (j = 0; j < nwords; j++)
+				nbits += __builtin_popcountll(acc[j]);
+		}
+		q->count += nbits;
+	}
+}
+
+int
+bmap_inter64_batch_count(struct bmap_query *q, int nq)
+{
+	struct bmap **all;
+	struct batch_freq *freq;
+	struct batch_ent *ent;
+	const int nwords = NBITS / (CHAR_BIT * sizeof(uint64_t));
+	int nall, nfreq;
+	int i, j, g;
+
+	for (nall = 0, i = 0; i < nq; i++) {
+		if (q[i].nops < 1)
+			return -1;
+		nall += q[i].nops;
+	}
+
+	all = malloc(nall * sizeof(*all));
+	freq = malloc(nall * sizeof(*freq));
+	ent = malloc(nq * sizeof(*ent));
+	if (all == NULL || freq == NULL || ent == NULL) {
+		free(all);
+		free(freq);
+		free(ent);
+		return -1;
+	}
+
+	/* Count how many queries use each operand. */
+	for (nall = 0, i = 0; i < nq; i++)
+		for (j = 0; j < q[i].nops; j++)
+			all[nall++] = q[i].ops[j];
+	qsort(all, nall, sizeof(*all), batch_ptrcmp);
+	for (nfreq = 0, i = 0; i < nall; i++) {
+		if (nfreq > 0 && freq[nfreq - 1].b == all[i]) {
+			freq[nfreq - 1].n++;
+		} else {
+			freq[nfreq].b = all[i];
+			freq[nfreq++].n = 1;
+		}
+	}
+
+	/* Key each query on its most shared operand and group by key. */
+	for (i = 0; i < nq; i++) {
+		int best = -1;
+
+		for (j = 0; j < q[i].nops; j++) {
+			int n = batch_freq(freq, nfreq, q[i].ops[j]);
+			if (n > best) {
+				best = n;
+				ent[i].key = q[i].ops[j];
+			}
+		}
+		ent[i].q = &q[i];
+		q[i].count = 0;
+	}
+	qsort(ent, nq, sizeof(*ent), batch_entcmp);
+
+	for (j = 0; j < nwords; j += BATCH_BLOCK_WORDS) {
+		int n = nwords - j < BATCH_BLOCK_WORDS ? nwords - j : BATCH_BLOCK_WORDS;
+
+		for (g = 0; g < nq; g = i) {
+			for (i = g + 1; i < nq && ent[i].key == ent[g].key; i++)
+				;
+			batch_block(&ent[g], i - g, j, n);
+		}
+	}
+
+	free(all);
+	free(freq);
+	free(ent);
+	return 0;
+}
+
+#ifdef __AVX__
 
 int
 bmap_inter64_avx_u_count(struct bmap *r, struct bmap *s)
@@ -222,6 +390,17 @@ bmap_inter_avx_one(__m256i * restrict d1, const __m256i * restrict d2) {
 	return nbits;
 }
 
+static inline int
+bmap_count_avx_one(const __m256i *d) {
+	__m256i v = _mm256_loadu_si256(d);
+	__m128i c1 = _mm256_extractf128_si256(v, 0);
+	__m128i c2 = _mm256_extractf128_si256(v, 1);
+	return __builtin_popcountll(_mm_extract_epi64(c1, 0)) +
+	    __builtin_popcountll(_mm_extract_epi64(c2, 0)) +
+	    __builtin_popcountll(_mm_extract_epi64(c1, 1)) +
+	    __builtin_popcountll(_mm_extract_epi64(c2, 1));
+}
+
 int
 bmap_inter64_avx_u_count_laterstore_unroll2(struct bmap *r, struct bmap *s)
 {
@@ -577,3 +756,316 @@ bmap_inter64_avx_a_postavxcount_r_ps(struct bmap * __restrict r, struct bmap * _
 }
 
 #endif
+
+/*
+ * Operations restricted to the bits [lo, hi).
+ *
+ * The first and last words are masked, everything between is done on
+ * whole words so the cost depends on the width of the range and not on
+ * NBITS.
+ */
+
+static inline uint64_t
+range_first_mask(int lo)
+{
+	return ~0ULL << (lo % WBITS);
+}
+
+static inline uint64_t
+range_last_mask(int hi)
+{
+	return ~0ULL >> (WBITS - 1 - (hi - 1) % WBITS);
+}
+
+int
+bmap_count_range(struct bmap *b, int lo, int hi)
+{
+	uint64_t *d = b->bits;
+	int lw = lo / WBITS, hw = (hi - 1) / WBITS;
+	int nbits;
+	int i;
+
+	if (lo >= hi)
+		return 0;
+	if (lw == hw)
+		return __builtin_popcountll(d[lw] & range_first_mask(lo) & range_last_mask(hi));
+
+	nbits = __builtin_popcountll(d[lw] & range_first_mask(lo));
+	i = lw + 1;
+#ifdef __AVX__
+	/* Scalar up to the first 256 bit boundary, then vectors. */
+	for (; i < hw && i % 4 != 0; i++)
+		nbits += __builtin_popcountll(d[i]);
+	for (; i + 4 <= hw; i += 4)
+		nbits += bmap_count_avx_one((__m256i *)&d[i]);
+#endif
+	for (; i < hw; i++)
+		nbits += __builtin_popcountll(d[i]);
+	nbits += __builtin_popcountll(d[hw] & range_last_mask(hi));
+	return nbits;
+}
+
+static inline void
+range_fill(struct bmap *b, int lo, int hi, int c)
+{
+	uint64_t *d = b->bits;
+	int lw = lo / WBITS, hw = (hi - 1) / WBITS;
+	uint64_t fm, lm;
+
+	if (lo >= hi)
+		return;
+	fm = range_first_mask(lo);
+	lm = range_last_mask(hi);
+	if (lw == hw)
+		fm = lm = fm & lm;
+	if (c) {
+		d[lw] |= fm;
+		d[hw] |= lm;
+	} else {
+		d[lw] &= ~fm;
+		d[hw] &= ~lm;
+	}
+	if (hw - lw > 1)
+		memset(&d[lw + 1], c ? 0xff : 0, (hw - lw - 1) * sizeof(*d));
+}
+
+void
+bmap_set_range(struct bmap *b, int lo, int hi)
+{
+	range_fill(b, lo, hi, 1);
+}
+
+void
+bmap_clear_range(struct bmap *b, int lo, int hi)
+{
+	range_fill(b, lo, hi, 0);
+}
+
+/*
+ * Intersect r with s and count the result, but only within [lo, hi). Bits
+ * in r outside the range are left alone.
+ */
+int
+bmap_inter_count_range(struct bmap *r, struct bmap *s, int lo, int hi)
+{
+	uint64_t *d = r->bits;
+	uint64_t *d2 = s->bits;
+	int lw = lo / WBITS, hw = (hi - 1) / WBITS;
+	uint64_t m;
+	int nbits = 0;
+	int i;
+
+	if (lo >= hi)
+		return 0;
+	if (lw == hw) {
+		m = range_first_mask(lo) & range_last_mask(hi);
+		d[lw] &= d2[lw] | ~m;
+		return __builtin_popcountll(d[lw] & m);
+	}
+
+	m = range_first_mask(lo);
+	d[lw] &= d2[lw] | ~m;
+	nbits += __builtin_popcountll(d[lw] & m);
+	i = lw + 1;
+#ifdef __AVX__
+	/* Scalar up to the first 256 bit boundary, then vectors. */
+	for (; i < hw && i % 4 != 0; i++)
+		nbits += __builtin_popcountll(d[i] &= d2[i]);
+	for (; i + 4 <= hw; i += 4)
+		nbits += bmap_inter_avx_one((__m256i *)&d[i], (__m256i *)&d2[i]);
+#endif
+	for (; i < hw; i++)
+		nbits += __builtin_popcountll(d[i] &= d2[i]);
+	m = range_last_mask(hi);
+	d[hw] &= d2[hw] | ~m;
+	nbits += __builtin_popcountll(d[hw] & m);
+	return nbits;
+}
+
+/*
+ * Estimate the size of the intersection of r and s without looking at all
+ * of it.
+ *
+ * The bitmaps are split into blocks of one cache line each and the blocks
+ * into equally sized strata. We pick one random block from each stratum,
+ * count the intersection in the picked blocks and scale up. The error
+ * bound comes from the variance of the sampled counts and Student's t,
+ * so it holds for bitmaps where the bits are spread out, not for
+ * something like a handful of dense blocks that the sample can miss
+ * entirely. A small pilot sample tells us the variance, if that says the
+ * pilot isn't enough we sample again with as many strata as needed, or
+ * count the rest of the blocks if that's cheaper.
+ *
+ * err is the allowed error as a fraction of NBITS, confidence is the
+ * probability that the real count is within [lo, hi]. seed is the state
+ * of the random number generator, any value will do and it's updated for
+ * the next call. Neither r nor s is modified.
+ */
+#define EST_BLOCK_WORDS 8
+#define EST_NBLOCKS (NBITS / (CHAR_BIT * sizeof(uint64_t) * EST_BLOCK_WORDS))
+#define EST_BLOCK_BITS (CHAR_BIT * sizeof(uint64_t) * EST_BLOCK_WORDS)
+#define EST_PILOT 16
+
+/*
+ * z such that a standard normal variable is within +/- z with probability
+ * p. Abramowitz & Stegun 26.2.23, good to 4.5e-4 which is more than
+ * enough for an error bound.
+ */
+static double
+est_z(double p)
+{
+	double q = (1 - p) / 2, t;
+
+	if (q >= 0.5)
+		return 0;
+	if (q < 1e-300)
+		q = 1e-300;
+	t = sqrt(-2 * log(q));
+	return t - (2.515517 + 0.802853 * t + 0.010328 * t * t) /
+	    (1 + 1.432788 * t + 0.189269 * t * t + 0.001308 * t * t * t);
+}
+
+/*
+ * Same for Student's t with df degrees of freedom, the variance is
+ * estimated from the sample so the normal quantile makes the interval too
+ * narrow. Abramowitz & Stegun 26.7.5, within 1% of the real value
+ * from 5 degrees of freedom up.
+ */
+static double
+est_t(double p, int df)
+{
+	double z = est_z(p), z2 = z * z, n = df;
+
+	return z + z * (z2 + 1) / (4 * n) +
+	    z * ((5 * z2 + 16) * z2 + 3) / (96 * n * n) +
+	    z * (((3 * z2 + 19) * z2 + 17) * z2 - 15) / (384 * n * n * n) +
+	    z * ((((79 * z2 + 776) * z2 + 1482) * z2 - 1920) * z2 - 945) / (92160 * n * n * n * n);
+}
+
+/*
+ * Count the intersection in m blocks, one random block from each stratum.
+ * The word offsets of the blocks are left in w, in increasing order.
+ */
+static void
+est_sample(struct bmap *r, struct bmap *s, int m, uint32_t *seed, int *w, double *mean, double *var)
+{
+	uint64_t *d = r->bits;
+	uint64_t *d2 = s->bits;
+	double sum = 0, sum2 = 0;
+	uint32_t rnd = *seed;
+	int i, j;
+
+	/*
+	 * Pick the blocks and prefetch them all first. The blocks are all
+	 * over the place, so the loads would miss the cache one after the
+	 * other.
+	 */
+	for (i = 0; i < m; i++) {
+		int first = i * EST_NBLOCKS / m;
+		int n = (i + 1) * EST_NBLOCKS / m - first;
+
+		rnd = rnd * 1664525 + 1013904223;
+		w[i] = (first + (rnd >> 8) % n) * EST_BLOCK_WORDS;
+		__builtin_prefetch(&d[w[i]]);
+		__builtin_prefetch(&d2[w[i]]);
+	}
+	*seed = rnd;
+	for (i = 0; i < m; i++) {
+		int nbits = 0;
+
+		for (j = 0; j < EST_BLOCK_WORDS; j++)
+			nbits += __builtin_popcountll(d[w[i] + j] & d2[w[i] + j]);
+		sum += nbits;
+		sum2 += (double)nbits * nbits;
+	}
+	*mean = sum / m;
+	*var = m > 1 ? (sum2 - sum * sum / m) / (m - 1) : 0;
+}
+
+/*
+ * Count the intersection in the blocks that est_sample didn't look at.
+ */
+static int
+est_count_rest(struct bmap *r, struct bmap *s, const int *w, int m)
+{
+	uint64_t *d = r->bits;
+	uint64_t *d2 = s->bits;
+	int nbits = 0;
+	int i, j, k;
+
+	for (i = 0, k = 0; i < NBITS / WBITS; i += EST_BLOCK_WORDS) {
+		if (k < m && w[k] == i) {
+			k++;
+			continue;
+		}
+		for (j = i; j < i + EST_BLOCK_WORDS; j++)
+			nbits += __builtin_popcountll(d[j] & d2[j]);
+	}
+	return nbits;
+}
+
+struct bmap_estimate
+bmap_inter_count_estimate(struct bmap *r, struct bmap *s, double err, double confidence, uint32_t *seed)
+{
+	struct bmap_estimate est;
+	double t, e, p, mean, var, need, hw;
+	int w[EST_NBLOCKS];
+	int m = EST_PILOT < EST_NBLOCKS ? EST_PILOT : EST_NBLOCKS;
+	int m2;
+
+	if (err <= 0 || confidence >= 1 || m < 2) {
+		est.count = est.lo = est.hi = bmap_inter64_count_nostore(r, s);
+		est.sampled = NBITS / WBITS;
+		return est;
+	}
+
+	e = err * NBITS;
+	est_sample(r, s, m, seed, w, &mean, &var);
+	est.sampled = m * EST_BLOCK_WORDS;
+
+	/*
+	 * A handful of small counts underestimates the variance more often
+	 * than not, so don't go below what independent bits at the sampled
+	 * density would give. If no bit was set (or every bit was) that
+	 * would be 0, use the upper bound on the density of the bits that
+	 * differ instead, the rule of three.
+	 */
+	p = mean / EST_BLOCK_BITS;
+	if (p == 0 || p == 1)
+		p = -log(1 - confidence) / (m * EST_BLOCK_BITS);
+	if (var < EST_BLOCK_BITS * p * (1 - p))
+		var = EST_BLOCK_BITS * p * (1 - p);
+
+	/*
+	 * Samples needed for the requested error, with finite population
+	 * correction. If the pilot isn't enough this is Stein's two stage
+	 * procedure: the interval keeps the variance and t of the pilot and
+	 * only the mean comes from the new sample. Taking the variance from
+	 * the new sample would look better, but we only get here when the
+	 * pilot variance came out high, so the intervals end up too narrow
+	 * on average.
+	 */
+	t = est_t(confidence, m - 1);
+	need = t * t * var * EST_NBLOCKS * EST_NBLOCKS / (e * e);
+	need = need / (1 + need / EST_NBLOCKS);
+	if (need > m) {
+		double var2;
+
+		m2 = need * 1.1 + 1;
+		if (m2 >= EST_NBLOCKS - m) {
+			/* Counting what the pilot didn't look at is cheaper. */
+			est.count = est.lo = est.hi = mean * m + est_count_rest(r, s, w, m);
+			est.sampled = NBITS / WBITS;
+			return est;
+		}
+		m = m2;
+		est_sample(r, s, m, seed, w, &mean, &var2);
+		est.sampled += m * EST_BLOCK_WORDS;
+	}
+
+	hw = t * EST_NBLOCKS * sqrt(var / m * (1 - (double)m / EST_NBLOCKS));
+	est.count = floor(mean * EST_NBLOCKS + 0.5);
+	est.lo = est.count - hw < 0 ? 0 : floor(est.count - hw);
+	est.hi = est.count + hw > NBITS ? NBITS : ceil(est.count + hw);
+	return est;
+}
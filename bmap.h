@@ -14,6 +14,8 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <stdint.h>
+
 struct bmap {
 	void *bits;
 };
@@ -25,6 +27,74 @@ int bmap_inter64_count(struct bmap *r, struct bmap *s);
 int bmap_inter64_postcount(struct bmap *r, struct bmap *s);
 int bmap_inter64_count_r(struct bmap * __restrict r, struct bmap * __restrict s);
 int bmap_inter64_postcount_r(struct bmap * __restrict r, struct bmap * __restrict s);
+int bmap_inter64_count_nostore(struct bmap *r, struct bmap *s);
+
+/*
+ * One pending query for the batch executor. The count of the
+ * intersection of all nops bitmaps in ops is returned in count.
+ */
+struct bmap_query {
+	struct bmap **ops;
+	int nops;
+	int count;
+};
+int bmap_inter64_batch_count(struct bmap_query *q, int nq);
+
+/*
+ * Operations on the bits [lo, hi) only. 0 <= lo <= hi <= NBITS is required,
+ * lo == hi is an empty range.
+ */
+int bmap_count_range(struct bmap *b, int lo, int hi);
+void bmap_set_range(struct bmap *b, int lo, int hi);
+void bmap_clear_range(struct bmap *b, int lo, int hi);
+int bmap_inter_count_range(struct bmap *r, struct bmap *s, int lo, int hi);
+
+/*
+ * Estimated intersection count, the real count is within [lo, hi] with
+ * the requested confidence if the set bits are spread out. sampled is the
+ * number of words looked at, never more than counting everything. err <= 0
+ * or confidence >= 1 gives the exact count. seed is random number state
+ * owned by the caller.
+ */
+struct bmap_estimate {
+	int count;
+	int lo, hi;
+	int sampled;
+};
+struct bmap_estimate bmap_inter_count_estimate(struct bmap *r, struct bmap *s, double err, double confidence, uint32_t *seed);
+
+/*
+ * EWAH compressed bitmap, see bmap_ewah.c for the format. Malformed
+ * streams make the counts return -1 and decode and inter return NULL.
+ */
+struct bmap_ewah {
+	uint64_t *words;
+	int nwords;
+	int size;
+};
+struct bmap_ewah *bmap_ewah_encode(struct bmap *b);
+struct bmap *bmap_ewah_decode(struct bmap_ewah *e);
+void bmap_ewah_free(struct bmap_ewah *e);
+int bmap_ewah_count(struct bmap_ewah *e);
+int bmap_ewah_inter_count(struct bmap_ewah *r, struct bmap_ewah *s);
+struct bmap_ewah *bmap_ewah_inter(struct bmap_ewah *r, struct bmap_ewah *s);
+
+/*
+ * Asynchronous loader for bitmaps stored in a file, see bmap_loader.c.
+ * A loader can be used from several threads at once.
+ */
+struct bmap_loader;
+#define BMAP_LOADER_NOURING	0x01	/* Use the pread thread pool even if io_uring works. */
+struct bmap_loader *bmap_loader_open(const char *path, int ncache, int flags);
+void bmap_loader_close(struct bmap_loader *l);
+const char *bmap_loader_backend(struct bmap_loader *l);
+unsigned long bmap_loader_nreads(struct bmap_loader *l);
+void bmap_loader_prefetch(struct bmap_loader *l, int id);
+struct bmap *bmap_loader_get(struct bmap_loader *l, int id);
+void bmap_loader_put(struct bmap_loader *l, int id);
+int bmap_loader_inter_count(struct bmap_loader *l, const int *ids, int *counts, int nq);
+int bmap_loader_write(const char *path, struct bmap **b, int n);
+
 #ifdef __AVX__
 int bmap_inter64_avx_u_count(struct bmap *r, struct bmap *s);
 int bmap_inter64_avx_u_count_latestore(struct bmap *r, struct bmap *s);
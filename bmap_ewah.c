@@ -0,0 +1,405 @@
+/*
+ * Copyright (c) 2014 Artur Grabowski <art@blahonga.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * EWAH (Enhanced Word-Aligned Hybrid) compressed bitmaps.
+ *
+ * The stream is a sequence of marker words, each followed by the literal
+ * words it describes. A marker says: "first comes a run of N clean words
+ * that are all 0 or all 1, then come M literal words". Marker layout:
+ *
+ *  bit 0       - value of the clean words in the run.
+ *  bits 1-32   - number of clean words in the run.
+ *  bits 33-63  - number of literal words following the marker.
+ *
+ * The kernels walk the streams without decompressing them. Two runs, or a
+ * run of zeroes against anything, are skipped in one step. Only literal
+ * words against literal words need to be looked at word by word.
+ *
+ * Streams come from disk, so they are not trusted. A stream that doesn't
+ * describe exactly NBITS bits or whose literals run past the end of the
+ * stream is rejected, the count functions return -1 and the functions
+ * returning bitmaps return NULL.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <string.h>
+
+#include "bmap.h"
+#include "bmap_internal.h"
+
+#define EWAH_RUNMAX ((1ULL << 32) - 1)
+#define EWAH_LITMAX ((1ULL << 31) - 1)
+
+#define EWAH_RBIT(m) ((int)((m) & 1))
+#define EWAH_RLEN(m) (((m) >> 1) & EWAH_RUNMAX)
+#define EWAH_NLIT(m) ((m) >> 33)
+#define EWAH_MARKER(b, r, l) ((uint64_t)(b) | (uint64_t)(r) << 1 | (uint64_t)(l) << 33)
+
+#define NWORDS (NBITS / WBITS)
+
+struct ewah_builder {
+	struct bmap_ewah *e;
+	int m;			/* Index of the current marker, -1 before the first one. */
+	int failed;
+};
+
+struct ewah_it {
+	const uint64_t *w, *end;
+	uint64_t rlen;		/* Clean words left in the current run. */
+	int rbit;
+	uint64_t nlit;		/* Literal words left after the run. */
+	const uint64_t *lit;
+	uint64_t pos;		/* Words described by the markers read so far. */
+	int bad;
+};
+
+static void
+ewah_push(struct ewah_builder *bd, uint64_t w)
+{
+	struct bmap_ewah *e = bd->e;
+
+	if (e->nwords == e->size) {
+		int nsize = e->size ? e->size * 2 : 16;
+		uint64_t *nw;
+
+		if ((nw = realloc(e->words, nsize * sizeof(*nw))) == NULL) {
+			bd->failed = 1;
+			return;
+		}
+		e->words = nw;
+		e->size = nsize;
+	}
+	e->words[e->nwords++] = w;
+}
+
+static void
+ewah_new_marker(struct ewah_builder *bd)
+{
+	ewah_push(bd, EWAH_MARKER(0, 0, 0));
+	if (!bd->failed)
+		bd->m = bd->e->nwords - 1;
+}
+
+static void
+ewah_add_run(struct ewah_builder *bd, int bit, uint64_t n)
+{
+	while (n && !bd->failed) {
+		uint64_t m, k;
+
+		if (bd->m == -1)
+			ewah_new_marker(bd);
+		else {
+			m = bd->e->words[bd->m];
+			if (EWAH_NLIT(m) || EWAH_RLEN(m) == EWAH_RUNMAX || (EWAH_RLEN(m) && EWAH_RBIT(m) != bit))
+				ewah_new_marker(bd);
+		}
+		if (bd->failed)
+			return;
+		m = bd->e->words[bd->m];
+		k = EWAH_RUNMAX - EWAH_RLEN(m);
+		if (k > n)
+			k = n;
+		bd->e->words[bd->m] = EWAH_MARKER(bit, EWAH_RLEN(m) + k, 0);
+		n -= k;
+	}
+}
+
+static void
+ewah_add_word(struct ewah_builder *bd, uint64_t w)
+{
+	if (w == 0 || w == ~0ULL) {
+		ewah_add_run(bd, w & 1, 1);
+		return;
+	}
+	if (bd->m == -1 || EWAH_NLIT(bd->e->words[bd->m]) == EWAH_LITMAX)
+		ewah_new_marker(bd);
+	ewah_push(bd, w);
+	if (!bd->failed)
+		bd->e->words[bd->m] += EWAH_MARKER(0, 0, 1);
+}
+
+static struct bmap_ewah *
+ewah_builder_init(struct ewah_builder *bd)
+{
+	bd->m = -1;
+	bd->failed = 0;
+	bd->e = calloc(1, sizeof(*bd->e));
+	return bd->e;
+}
+
+static struct bmap_ewah *
+ewah_builder_done(struct ewah_builder *bd)
+{
+	if (bd->failed) {
+		bmap_ewah_free(bd->e);
+		return NULL;
+	}
+	return bd->e;
+}
+
+static void
+ewah_it_init(struct ewah_it *it, const struct bmap_ewah *e)
+{
+	it->w = e->words;
+	it->end = e->words + e->nwords;
+	it->rlen = it->nlit = 0;
+	it->pos = 0;
+	it->bad = 0;
+}
+
+/* The whole stream was consumed and it was well formed. */
+static inline int
+ewah_it_ok(const struct ewah_it *it)
+{
+	return !it->bad && it->pos == NWORDS && it->rlen == 0 && it->nlit == 0 && it->w == it->end;
+}
+
+/*
+ * Make sure the iterator points at something, skip markers with nothing
+ * in them. Returns 0 when the stream is exhausted or bad.
+ */
+static inline int
+ewah_it_fill(struct ewah_it *it)
+{
+	while (it->rlen == 0 && it->nlit == 0) {
+		uint64_t m;
+
+		if (it->w == it->end)
+			return 0;
+		m = *it->w++;
+		it->rbit = EWAH_RBIT(m);
+		it->rlen = EWAH_RLEN(m);
+		it->nlit = EWAH_NLIT(m);
+		if (it->nlit > (uint64_t)(it->end - it->w) || it->rlen + it->nlit > NWORDS - it->pos) {
+			it->rlen = it->nlit = 0;
+			it->bad = 1;
+			return 0;
+		}
+		it->pos += it->rlen + it->nlit;
+		it->lit = it->w;
+		it->w += it->nlit;
+	}
+	return 1;
+}
+
+static inline void
+ewah_it_skip_lit(struct ewah_it *it, uint64_t n)
+{
+	it->lit += n;
+	it->nlit -= n;
+}
+
+static int
+ewah_popcount(const uint64_t *a, uint64_t n)
+{
+	int nbits = 0;
+	uint64_t i;
+
+	for (i = 0; i < n; i++)
+		nbits += __builtin_popcountll(a[i]);
+	return nbits;
+}
+
+/*
+ * AND n literal words and count the result. If d isn't NULL the result
+ * is stored there too. Literals are only 8 byte aligned in the stream,
+ * so the unaligned loads it is.
+ */
+static int
+ewah_and_count(const uint64_t *a, const uint64_t *b, uint64_t *d, uint64_t n)
+{
+	int nbits = 0;
+	uint64_t i = 0;
+
+#ifdef __AVX__
+	for (; i + 4 <= n; i += 4) {
+		__m256i v = mm256_and_si256(_mm256_loadu_si256((const __m256i *)&a[i]), _mm256_loadu_si256((const __m256i *)&b[i]));
+		__m128i c1 = _mm256_extractf128_si256(v, 0);
+		__m128i c2 = _mm256_extractf128_si256(v, 1);
+		nbits +=
+			__builtin_popcountll(_mm_extract_epi64(c1, 0)) +
+			__builtin_popcountll(_mm_extract_epi64(c2, 0)) +
+			__builtin_popcountll(_mm_extract_epi64(c1, 1)) +
+			__builtin_popcountll(_mm_extract_epi64(c2, 1));
+		if (d)
+			_mm256_storeu_si256((__m256i *)&d[i], v);
+	}
+#endif
+	for (; i < n; i++) {
+		uint64_t v = a[i] & b[i];
+		nbits += __builtin_popcountll(v);
+		if (d)
+			d[i] = v;
+	}
+	return nbits;
+}
+
+struct bmap_ewah *
+bmap_ewah_encode(struct bmap *b)
+{
+	struct ewah_builder bd;
+	uint64_t *d = b->bits;
+	int i;
+
+	if (ewah_builder_init(&bd) == NULL)
+		return NULL;
+	for (i = 0; i < NWORDS; i++)
+		ewah_add_word(&bd, d[i]);
+	return ewah_builder_done(&bd);
+}
+
+struct bmap *
+bmap_ewah_decode(struct bmap_ewah *e)
+{
+	struct bmap *b = bmap_alloc();
+	uint64_t *d = b->bits;
+	struct ewah_it it;
+
+	ewah_it_init(&it, e);
+	while (ewah_it_fill(&it)) {
+		if (it.rbit)
+			memset(d, 0xff, it.rlen * sizeof(*d));
+		d += it.rlen;
+		memcpy(d, it.lit, it.nlit * sizeof(*d));
+		d += it.nlit;
+		it.rlen = it.nlit = 0;
+	}
+	if (!ewah_it_ok(&it)) {
+		free(b->bits);
+		free(b);
+		return NULL;
+	}
+	return b;
+}
+
+void
+bmap_ewah_free(struct bmap_ewah *e)
+{
+	if (e == NULL)
+		return;
+	free(e->words);
+	free(e);
+}
+
+int
+bmap_ewah_count(struct bmap_ewah *e)
+{
+	struct ewah_it it;
+	int nbits = 0;
+
+	ewah_it_init(&it, e);
+	while (ewah_it_fill(&it)) {
+		if (it.rbit)
+			nbits += it.rlen * WBITS;
+		nbits += ewah_popcount(it.lit, it.nlit);
+		it.rlen = it.nlit = 0;
+	}
+	return ewah_it_ok(&it) ? nbits : -1;
+}
+
+int
+bmap_ewah_inter_count(struct bmap_ewah *r, struct bmap_ewah *s)
+{
+	struct ewah_it a, b;
+	int nbits = 0;
+	uint64_t n;
+
+	ewah_it_init(&a, r);
+	ewah_it_init(&b, s);
+	while (ewah_it_fill(&a) && ewah_it_fill(&b)) {
+		if (a.rlen && b.rlen) {
+			n = a.rlen < b.rlen ? a.rlen : b.rlen;
+			if (a.rbit && b.rbit)
+				nbits += n * WBITS;
+			a.rlen -= n;
+			b.rlen -= n;
+		} else if (a.rlen || b.rlen) {
+			struct ewah_it *run = a.rlen ? &a : &b;
+			struct ewah_it *lit = a.rlen ? &b : &a;
+
+			n = run->rlen < lit->nlit ? run->rlen : lit->nlit;
+			if (run->rbit)
+				nbits += ewah_popcount(lit->lit, n);
+			run->rlen -= n;
+			ewah_it_skip_lit(lit, n);
+		} else {
+			n = a.nlit < b.nlit ? a.nlit : b.nlit;
+			nbits += ewah_and_count(a.lit, b.lit, NULL, n);
+			ewah_it_skip_lit(&a, n);
+			ewah_it_skip_lit(&b, n);
+		}
+	}
+	/* The loop stops when either stream ends, read the rest of the other. */
+	ewah_it_fill(&a);
+	ewah_it_fill(&b);
+	return ewah_it_ok(&a) && ewah_it_ok(&b) ? nbits : -1;
+}
+
+/*
+ * Same walk as bmap_ewah_inter_count, but builds the compressed result.
+ */
+struct bmap_ewah *
+bmap_ewah_inter(struct bmap_ewah *r, struct bmap_ewah *s)
+{
+	struct ewah_builder bd;
+	struct ewah_it a, b;
+	uint64_t tmp[64];
+	uint64_t i, n;
+
+	if (ewah_builder_init(&bd) == NULL)
+		return NULL;
+	ewah_it_init(&a, r);
+	ewah_it_init(&b, s);
+	while (ewah_it_fill(&a) && ewah_it_fill(&b) && !bd.failed) {
+		if (a.rlen && b.rlen) {
+			n = a.rlen < b.rlen ? a.rlen : b.rlen;
+			ewah_add_run(&bd, a.rbit & b.rbit, n);
+			a.rlen -= n;
+			b.rlen -= n;
+		} else if (a.rlen || b.rlen) {
+			struct ewah_it *run = a.rlen ? &a : &b;
+			struct ewah_it *lit = a.rlen ? &b : &a;
+
+			n = run->rlen < lit->nlit ? run->rlen : lit->nlit;
+			if (run->rbit) {
+				for (i = 0; i < n; i++)
+					ewah_add_word(&bd, lit->lit[i]);
+			} else {
+				ewah_add_run(&bd, 0, n);
+			}
+			run->rlen -= n;
+			ewah_it_skip_lit(lit, n);
+		} else {
+			n = a.nlit < b.nlit ? a.nlit : b.nlit;
+			if (n > sizeof(tmp) / sizeof(tmp[0]))
+				n = sizeof(tmp) / sizeof(tmp[0]);
+			ewah_and_count(a.lit, b.lit, tmp, n);
+			for (i = 0; i < n; i++)
+				ewah_add_word(&bd, tmp[i]);
+			ewah_it_skip_lit(&a, n);
+			ewah_it_skip_lit(&b, n);
+		}
+	}
+	ewah_it_fill(&a);
+	ewah_it_fill(&b);
+	if (!ewah_it_ok(&a) || !ewah_it_ok(&b))
+		bd.failed = 1;
+	return ewah_builder_done(&bd);
+}
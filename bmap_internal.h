@@ -0,0 +1,35 @@
+/*
+ * Copyright (c) 2014 Artur Grabowski <art@blahonga.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Things shared between the implementation files, not part of the API.
+ */
+
+#define WBITS (CHAR_BIT * sizeof(uint64_t))
+
+#ifdef __AVX__
+#include <immintrin.h>
+
+/*
+ * The lack of this instruction is hilarious.
+ *
+ * Why are there separate instructions that do the exact same things for single and double precision, but not
+ * for ints where bit operations actually make sense. It's all casts anyway. Or is it? Two versions to test if
+ * double vs. single precision makes sense.
+ */
+#define mm256_and_si256(v1, v2) _mm256_castpd_si256(_mm256_and_pd(_mm256_castsi256_pd(v1), _mm256_castsi256_pd(v2)))
+#define mm256_and_si256_ps(v1, v2) _mm256_castps_si256(_mm256_and_ps(_mm256_castsi256_ps(v1), _mm256_castsi256_ps(v2)))
+#endif
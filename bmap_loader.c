@@ -0,0 +1,697 @@
+/*
+ * Copyright (c) 2014 Artur Grabowski <art@blahonga.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Asynchronous loading of bitmaps from a file that doesn't fit in memory.
+ *
+ * The file is just the bitmap payloads back to back, bitmap number id is
+ * at offset id * NBITS / CHAR_BIT. Loaded bitmaps live in a fixed size
+ * LRU cache of buffers from bmap_alloc. Reads are issued with io_uring
+ * on Linux and with a small pool of threads doing pread everywhere else
+ * (or when io_uring isn't available, which is common in containers).
+ *
+ * Everything is protected by one mutex. With io_uring there are no other
+ * threads, completions are reaped by whoever waits for them. Only one
+ * thread at a time reaps and it drops the mutex while it sleeps in the
+ * kernel, the others wait for it on a condition variable.
+ *
+ * The io_uring backend needs the 5.6 kernel headers to build, without
+ * them only the thread pool is built.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/queue.h>
+
+#include "bmap.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+#ifdef IO_URING_OP_SUPPORTED
+#define LOADER_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#define BSIZE (NBITS / CHAR_BIT)
+#define LOADER_NTHREADS 4
+
+enum ent_state {
+	ENT_FREE,
+	ENT_LOADING,
+	ENT_READY,
+	ENT_ERROR,
+};
+
+struct cache_ent {
+	int id;
+	enum ent_state state;
+	int pins;
+	struct bmap *b;
+	struct cache_ent *hnext;
+	TAILQ_ENTRY(cache_ent) lru;
+	TAILQ_ENTRY(cache_ent) pending;
+};
+
+TAILQ_HEAD(ent_list, cache_ent);
+
+#ifdef LOADER_URING
+struct uring {
+	int fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_sz, cq_sz, sqes_sz;
+	unsigned queued;	/* In the ring, not yet passed to the kernel. */
+	unsigned inflight;
+};
+#endif
+
+struct bmap_loader {
+	int fd;
+	int ncache;
+	struct cache_ent *ents;
+	struct cache_ent **hash;
+	struct ent_list lru;
+
+	pthread_mutex_t mtx;
+	pthread_cond_t done;
+
+#ifdef LOADER_URING
+	struct uring *uring;
+	int reaping;
+#endif
+
+	/* Thread pool fallback. */
+	int nthreads;
+	pthread_t threads[LOADER_NTHREADS];
+	pthread_cond_t work;
+	struct ent_list pending;
+	int quit;
+
+	unsigned long nreads;
+};
+
+static int
+pread_full(int fd, void *buf, size_t sz, off_t off)
+{
+	char *p = buf;
+
+	while (sz > 0) {
+		ssize_t r = pread(fd, p, sz, off);
+
+		if (r == -1 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		p += r;
+		sz -= r;
+		off += r;
+	}
+	return 0;
+}
+
+#ifdef LOADER_URING
+static int
+uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	int r;
+
+	do {
+		r = syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+	} while (r == -1 && errno == EINTR);
+	return r;
+}
+
+static void
+uring_free(struct uring *u)
+{
+	if (u->sqes != NULL && u->sqes != MAP_FAILED)
+		munmap(u->sqes, u->sqes_sz);
+	if (u->cq_ptr != NULL && u->cq_ptr != MAP_FAILED && u->cq_ptr != u->sq_ptr)
+		munmap(u->cq_ptr, u->cq_sz);
+	if (u->sq_ptr != NULL && u->sq_ptr != MAP_FAILED)
+		munmap(u->sq_ptr, u->sq_sz);
+	if (u->fd != -1)
+		close(u->fd);
+	free(u);
+}
+
+/*
+ * IORING_OP_READ showed up in 5.6, same as IORING_REGISTER_PROBE. Older
+ * kernels have io_uring, but would fail every read. Use the thread pool
+ * there.
+ */
+static int
+uring_probe_read(int fd)
+{
+	struct io_uring_probe *probe;
+	size_t sz = sizeof(*probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+	int ok = 0;
+
+	if ((probe = calloc(1, sz)) == NULL)
+		return 0;
+	if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0 &&
+	    probe->last_op >= IORING_OP_READ &&
+	    (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED))
+		ok = 1;
+	free(probe);
+	return ok;
+}
+
+static struct uring *
+uring_init(unsigned entries)
+{
+	struct io_uring_params p;
+	struct uring *u;
+	char *sq, *cq;
+
+	if ((u = calloc(1, sizeof(*u))) == NULL)
+		return NULL;
+	memset(&p, 0, sizeof(p));
+	if ((u->fd = syscall(__NR_io_uring_setup, entries, &p)) == -1) {
+		free(u);
+		return NULL;
+	}
+
+	u->sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_sz > u->sq_sz)
+			u->sq_sz = u->cq_sz;
+		u->cq_sz = u->sq_sz;
+	}
+	u->sq_ptr = mmap(NULL, u->sq_sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->sq_ptr == MAP_FAILED)
+		goto fail;
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		u->cq_ptr = u->sq_ptr;
+	else if ((u->cq_ptr = mmap(NULL, u->cq_sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_CQ_RING)) == MAP_FAILED)
+		goto fail;
+	u->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	if ((u->sqes = mmap(NULL, u->sqes_sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQES)) == MAP_FAILED)
+		goto fail;
+
+	if (!uring_probe_read(u->fd))
+		goto fail;
+
+	sq = u->sq_ptr;
+	cq = u->cq_ptr;
+	u->sq_head = (unsigned *)(sq + p.sq_off.head);
+	u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	u->sq_array = (unsigned *)(sq + p.sq_off.array);
+	u->cq_head = (unsigned *)(cq + p.cq_off.head);
+	u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return u;
+fail:
+	uring_free(u);
+	return NULL;
+}
+
+/*
+ * Put a read in the submission queue, uring_flush passes it to the
+ * kernel. The ring is sized to the cache and every entry has at most one
+ * read queued or in flight, so the submission queue can never be full
+ * here.
+ */
+static void
+uring_queue(struct bmap_loader *l, struct cache_ent *e)
+{
+	struct uring *u = l->uring;
+	unsigned tail = *u->sq_tail;
+	unsigned idx = tail & *u->sq_mask;
+	struct io_uring_sqe *sqe = &u->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = l->fd;
+	sqe->addr = (uintptr_t)e->b->bits;
+	sqe->len = BSIZE;
+	sqe->off = (uint64_t)e->id * BSIZE;
+	sqe->user_data = (uintptr_t)e;
+	u->sq_array[idx] = idx;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	u->queued++;
+}
+
+/*
+ * Submit everything queued with one system call. Returns the number of
+ * reads that failed to submit.
+ *
+ * Without SQPOLL the kernel only consumes submissions inside
+ * io_uring_enter and it consumes them in order, so whatever it didn't
+ * take when enter returns can be taken back out of the ring. What it
+ * took will complete, even if enter says otherwise.
+ */
+static int
+uring_flush(struct bmap_loader *l)
+{
+	struct uring *u = l->uring;
+	unsigned head, tail = *u->sq_tail;
+	int failed = 0;
+
+	if (u->queued == 0)
+		return 0;
+	uring_enter(u->fd, u->queued, 0, 0);
+	head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+	u->inflight += u->queued - (tail - head);
+	u->queued = 0;
+	if (head == tail)
+		return 0;
+	__atomic_store_n(u->sq_tail, head, __ATOMIC_RELEASE);
+	for (; head != tail; head++, failed++) {
+		struct io_uring_sqe *sqe = &u->sqes[head & *u->sq_mask];
+
+		((struct cache_ent *)(uintptr_t)sqe->user_data)->state = ENT_ERROR;
+	}
+	return failed;
+}
+
+/*
+ * Reap the completions that are there. Returns how many there were.
+ */
+static int
+uring_reap(struct uring *u)
+{
+	unsigned head, tail;
+	int n = 0;
+
+	head = *u->cq_head;
+	tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++, n++) {
+		struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+		struct cache_ent *e = (struct cache_ent *)(uintptr_t)cqe->user_data;
+
+		e->state = cqe->res == BSIZE ? ENT_READY : ENT_ERROR;
+		u->inflight--;
+	}
+	__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+	return n;
+}
+#endif
+
+static void *
+loader_thread(void *arg)
+{
+	struct bmap_loader *l = arg;
+	struct cache_ent *e;
+	int r;
+
+	pthread_mutex_lock(&l->mtx);
+	while (!l->quit) {
+		if ((e = TAILQ_FIRST(&l->pending)) == NULL) {
+			pthread_cond_wait(&l->work, &l->mtx);
+			continue;
+		}
+		TAILQ_REMOVE(&l->pending, e, pending);
+		pthread_mutex_unlock(&l->mtx);
+		/* Nobody touches the buffer of a loading entry. */
+		r = pread_full(l->fd, e->b->bits, BSIZE, (off_t)e->id * BSIZE);
+		pthread_mutex_lock(&l->mtx);
+		e->state = r ? ENT_ERROR : ENT_READY;
+		pthread_cond_broadcast(&l->done);
+	}
+	pthread_mutex_unlock(&l->mtx);
+	return NULL;
+}
+
+/*
+ * Pass queued reads on to the kernel. Must be done before the mutex is
+ * released or we wait for something.
+ */
+static void
+loader_flush(struct bmap_loader *l)
+{
+#ifdef LOADER_URING
+	if (l->uring && uring_flush(l))
+		pthread_cond_broadcast(&l->done);
+#endif
+}
+
+/*
+ * Wait for some read to finish. Called with the mutex held.
+ */
+static void
+loader_wait(struct bmap_loader *l)
+{
+#ifdef LOADER_URING
+	struct uring *u = l->uring;
+
+	if (u && !l->reaping) {
+		loader_flush(l);
+		l->reaping = 1;
+		if (uring_reap(u) == 0 && u->inflight) {
+			pthread_mutex_unlock(&l->mtx);
+			uring_enter(u->fd, 0, 1, IORING_ENTER_GETEVENTS);
+			pthread_mutex_lock(&l->mtx);
+			uring_reap(u);
+		}
+		l->reaping = 0;
+		pthread_cond_broadcast(&l->done);
+		return;
+	}
+#endif
+	pthread_cond_wait(&l->done, &l->mtx);
+}
+
+static struct cache_ent *
+loader_lookup(struct bmap_loader *l, int id)
+{
+	struct cache_ent *e;
+
+	for (e = l->hash[id % l->ncache]; e != NULL; e = e->hnext)
+		if (e->id == id)
+			return e;
+	return NULL;
+}
+
+static void
+loader_unhash(struct bmap_loader *l, struct cache_ent *e)
+{
+	struct cache_ent **ep;
+
+	for (ep = &l->hash[e->id % l->ncache]; *ep != e; ep = &(*ep)->hnext)
+		;
+	*ep = e->hnext;
+}
+
+static void
+loader_issue(struct bmap_loader *l, struct cache_ent *e)
+{
+	e->state = ENT_LOADING;
+	l->nreads++;
+#ifdef LOADER_URING
+	if (l->uring) {
+		uring_queue(l, e);
+		return;
+	}
+#endif
+	TAILQ_INSERT_TAIL(&l->pending, e, pending);
+	pthread_cond_signal(&l->work);
+}
+
+/*
+ * Find the entry for id or start loading it into the least recently used
+ * entry that's not pinned or being loaded. An entry whose last read failed
+ * is read again. Returns NULL if all entries are busy. Called with the
+ * mutex held, loader_flush has to be called before it's released.
+ */
+static struct cache_ent *
+loader_start(struct bmap_loader *l, int id)
+{
+	struct cache_ent *e;
+
+	if ((e = loader_lookup(l, id)) == NULL) {
+		TAILQ_FOREACH(e, &l->lru, lru)
+			if (e->pins == 0 && e->state != ENT_LOADING)
+				break;
+		if (e == NULL)
+			return NULL;
+		if (e->state != ENT_FREE)
+			loader_unhash(l, e);
+		e->id = id;
+		e->hnext = l->hash[id % l->ncache];
+		l->hash[id % l->ncache] = e;
+		loader_issue(l, e);
+	} else if (e->state == ENT_ERROR && e->pins == 0) {
+		loader_issue(l, e);
+	}
+	TAILQ_REMOVE(&l->lru, e, lru);
+	TAILQ_INSERT_TAIL(&l->lru, e, lru);
+	return e;
+}
+
+struct bmap_loader *
+bmap_loader_open(const char *path, int ncache, int flags)
+{
+	struct bmap_loader *l;
+	int i;
+
+	if (ncache < 4) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if ((l = calloc(1, sizeof(*l))) == NULL)
+		return NULL;
+	if ((l->fd = open(path, O_RDONLY)) == -1) {
+		free(l);
+		return NULL;
+	}
+	pthread_mutex_init(&l->mtx, NULL);
+	pthread_cond_init(&l->done, NULL);
+	pthread_cond_init(&l->work, NULL);
+	l->ncache = ncache;
+	l->ents = calloc(ncache, sizeof(*l->ents));
+	l->hash = calloc(ncache, sizeof(*l->hash));
+	if (l->ents == NULL || l->hash == NULL) {
+		bmap_loader_close(l);
+		errno = ENOMEM;
+		return NULL;
+	}
+	TAILQ_INIT(&l->lru);
+	TAILQ_INIT(&l->pending);
+	for (i = 0; i < ncache; i++) {
+		l->ents[i].b = bmap_alloc();
+		TAILQ_INSERT_TAIL(&l->lru, &l->ents[i], lru);
+	}
+
+#ifdef LOADER_URING
+	if ((flags & BMAP_LOADER_NOURING) == 0 && (l->uring = uring_init(ncache)) != NULL)
+		return l;
+#endif
+	for (i = 0; i < LOADER_NTHREADS; i++) {
+		if (pthread_create(&l->threads[i], NULL, loader_thread, l))
+			break;
+		l->nthreads++;
+	}
+	if (l->nthreads == 0) {
+		bmap_loader_close(l);
+		errno = EAGAIN;
+		return NULL;
+	}
+	return l;
+}
+
+void
+bmap_loader_close(struct bmap_loader *l)
+{
+	int i;
+
+	if (l->nthreads) {
+		pthread_mutex_lock(&l->mtx);
+		l->quit = 1;
+		pthread_cond_broadcast(&l->work);
+		pthread_mutex_unlock(&l->mtx);
+		for (i = 0; i < l->nthreads; i++)
+			pthread_join(l->threads[i], NULL);
+	}
+#ifdef LOADER_URING
+	if (l->uring) {
+		pthread_mutex_lock(&l->mtx);
+		while (l->uring->inflight)
+			loader_wait(l);
+		pthread_mutex_unlock(&l->mtx);
+		uring_free(l->uring);
+	}
+#endif
+	for (i = 0; l->ents != NULL && i < l->ncache; i++) {
+		if (l->ents[i].b) {
+			free(l->ents[i].b->bits);
+			free(l->ents[i].b);
+		}
+	}
+	pthread_mutex_destroy(&l->mtx);
+	pthread_cond_destroy(&l->done);
+	pthread_cond_destroy(&l->work);
+	free(l->ents);
+	free(l->hash);
+	close(l->fd);
+	free(l);
+}
+
+/*
+ * Number of reads issued so far.
+ */
+unsigned long
+bmap_loader_nreads(struct bmap_loader *l)
+{
+	unsigned long n;
+
+	pthread_mutex_lock(&l->mtx);
+	n = l->nreads;
+	pthread_mutex_unlock(&l->mtx);
+	return n;
+}
+
+const char *
+bmap_loader_backend(struct bmap_loader *l)
+{
+#ifdef LOADER_URING
+	if (l->uring)
+		return "io_uring";
+#endif
+	return "pread";
+}
+
+static void
+loader_prefetch(struct bmap_loader *l, const int *ids, int n)
+{
+	int i;
+
+	pthread_mutex_lock(&l->mtx);
+	for (i = 0; i < n; i++)
+		if (ids[i] >= 0)
+			loader_start(l, ids[i]);
+	loader_flush(l);
+	pthread_mutex_unlock(&l->mtx);
+}
+
+/*
+ * Start loading a bitmap we'll need soon. This is only a hint, if the
+ * cache is full of pinned and loading bitmaps nothing happens.
+ */
+void
+bmap_loader_prefetch(struct bmap_loader *l, int id)
+{
+	loader_prefetch(l, &id, 1);
+}
+
+/*
+ * Get a bitmap, waiting for it to be loaded if necessary. The bitmap is
+ * pinned in the cache until released with bmap_loader_put and must not be
+ * modified. Returns NULL if the read failed or every entry in the cache
+ * is pinned.
+ */
+struct bmap *
+bmap_loader_get(struct bmap_loader *l, int id)
+{
+	struct cache_ent *e;
+	struct bmap *b = NULL;
+
+	if (id < 0)
+		return NULL;
+	pthread_mutex_lock(&l->mtx);
+	while ((e = loader_start(l, id)) == NULL) {
+		TAILQ_FOREACH(e, &l->lru, lru)
+			if (e->state == ENT_LOADING)
+				break;
+		if (e == NULL)
+			goto out;
+		loader_wait(l);
+	}
+	e->pins++;
+	while (e->state == ENT_LOADING)
+		loader_wait(l);
+	if (e->state == ENT_READY)
+		b = e->b;
+	else
+		e->pins--;	/* Left in ENT_ERROR, loader_start reads it again. */
+out:
+	loader_flush(l);
+	pthread_mutex_unlock(&l->mtx);
+	return b;
+}
+
+void
+bmap_loader_put(struct bmap_loader *l, int id)
+{
+	struct cache_ent *e;
+
+	pthread_mutex_lock(&l->mtx);
+	if ((e = loader_lookup(l, id)) != NULL && e->pins > 0)
+		e->pins--;
+	pthread_mutex_unlock(&l->mtx);
+}
+
+/*
+ * Count the intersections of nq pairs of bitmaps, ids[2 * i] and
+ * ids[2 * i + 1] for query i. The reads for the next query are issued
+ * before the current intersection is done so that the disk works while
+ * we compute. The current pair is pinned before the next one is
+ * prefetched, otherwise the prefetch could evict it. Both reads of a
+ * query are submitted together.
+ */
+int
+bmap_loader_inter_count(struct bmap_loader *l, const int *ids, int *counts, int nq)
+{
+	struct bmap *r, *s;
+	int i;
+
+	if (nq > 0)
+		loader_prefetch(l, &ids[0], 2);
+	for (i = 0; i < nq; i++) {
+		r = bmap_loader_get(l, ids[2 * i]);
+		s = bmap_loader_get(l, ids[2 * i + 1]);
+		if (r == NULL || s == NULL) {
+			if (r)
+				bmap_loader_put(l, ids[2 * i]);
+			if (s)
+				bmap_loader_put(l, ids[2 * i + 1]);
+			return -1;
+		}
+		if (i + 1 < nq)
+			loader_prefetch(l, &ids[2 * i + 2], 2);
+		counts[i] = bmap_inter64_count_nostore(r, s);
+		bmap_loader_put(l, ids[2 * i]);
+		bmap_loader_put(l, ids[2 * i + 1]);
+	}
+	return 0;
+}
+
+/*
+ * Write bitmaps to a file in the format the loader expects.
+ */
+int
+bmap_loader_write(const char *path, struct bmap **b, int n)
+{
+	int fd, i;
+
+	if ((fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644)) == -1)
+		return -1;
+	for (i = 0; i < n; i++) {
+		const char *p = b[i]->bits;
+		size_t sz = BSIZE;
+
+		while (sz > 0) {
+			ssize_t r = write(fd, p, sz);
+
+			if (r == -1 && errno == EINTR)
+				continue;
+			if (r <= 0) {
+				close(fd);
+				return -1;
+			}
+			p += r;
+			sz -= r;
+		}
+	}
+	return close(fd);
+}
@@ -20,6 +20,8 @@
 #include <fcntl.h>
 #include <err.h>
 #include <limits.h>
+#include <string.h>
+#include <unistd.h>
 
 #include <stopwatch.h>
 
@@ -56,6 +58,748 @@ struct {
 #endif
 };
 
+static FILE *
+stat_open(const char *statdir, const char *n)
+{
+	char fname[PATH_MAX];
+	FILE *statfile;
+
+	if (statdir == NULL)
+		return NULL;
+	snprintf(fname, sizeof(fname), "%s/%s", statdir, n);
+	if ((statfile = fopen(fname, "w+")) == NULL)
+		err(1, "fopen(%s)", fname);
+	return statfile;
+}
+
+static void
+stat_report(FILE *statfile, const char *n, struct stopwatch *sw)
+{
+	printf("%s: %f\n", n, stopwatch_to_ns(sw) / 1000000000.0);
+	if (statfile)
+		fprintf(statfile, "%f\n", stopwatch_to_ns(sw) / 1000000000.0);
+}
+
+/*
+ * Random bitmap where each bit is set with probability 1/2^k.
+ */
+static struct bmap *
+alloc_density(int k)
+{
+	struct bmap *b = bmap_alloc();
+	uint64_t *d = b->bits;
+	int i, j;
+
+	for (i = 0; i < NBITS / (CHAR_BIT * sizeof(*d)); i++) {
+		d[i] = ~0ULL;
+		for (j = 0; j < k; j++)
+			d[i] &= (uint64_t)random() << 33 ^ (uint64_t)random() << 2 ^ random();
+	}
+	return b;
+}
+
+/*
+ * One query the way it would be done without the batch executor. The
+ * operands are shared, so n-way intersections are done on a copy.
+ */
+static int
+oneshot_count(struct bmap_query *q, struct bmap *tmp)
+{
+	int nbits = 0;
+	int i;
+
+	if (q->nops == 1)
+		return bmap_count(q->ops[0]);
+	if (q->nops == 2)
+		return bmap_inter64_count_nostore(q->ops[0], q->ops[1]);
+	memcpy(tmp->bits, q->ops[0]->bits, NBITS / CHAR_BIT);
+	for (i = 1; i < q->nops; i++)
+		nbits = bmap_inter64_count(tmp, q->ops[i]);
+	return nbits;
+}
+
+/*
+ * Many queries sharing a few hot operands. Compare issuing them one by one
+ * against handing them all to the batch executor. A third of the queries
+ * are single bitmap counts, a third intersect with a hot bitmap and a
+ * third also intersect with one of a few warm bitmaps that are shared, but
+ * less than the hot ones.
+ */
+static void
+test_batch(const char *statdir)
+{
+	const int nq = 4096;
+	const int nhot = 4;
+	const int nwarm = 64;
+	int nrep = 80;
+	struct stopwatch sw;
+	struct bmap *hot[nhot];
+	struct bmap *warm[nwarm];
+	struct bmap *bmaps[nq];
+	struct bmap *ops[nq][3];
+	struct bmap_query q[nq];
+	struct bmap *tmp;
+	int expect[nq];
+	FILE *sf1, *sf2;
+	int toprep, rep;
+	int i;
+
+	tmp = bmap_alloc();
+	for (i = 0; i < nhot; i++) {
+		hot[i] = bmap_alloc_rnd();
+		bmap_set_range(hot[i], random() % NBITS, random() % NBITS);
+	}
+	for (i = 0; i < nwarm; i++) {
+		warm[i] = bmap_alloc_rnd();
+		bmap_set_range(warm[i], random() % NBITS, random() % NBITS);
+	}
+	for (i = 0; i < nq; i++) {
+		bmaps[i] = bmap_alloc_rnd();
+		bmap_set_range(bmaps[i], random() % NBITS, random() % NBITS);
+		/* Put the hot operand in different places, the key isn't always first. */
+		ops[i][0] = bmaps[i];
+		ops[i][1] = warm[i % nwarm];
+		ops[i][2] = hot[i % nhot];
+		q[i].ops = ops[i];
+		switch (i % 3) {
+		case 0:
+			q[i].nops = 1;
+			break;
+		case 1:
+			ops[i][1] = hot[i % nhot];
+			q[i].nops = 2;
+			break;
+		case 2:
+			q[i].nops = 3;
+			break;
+		}
+		expect[i] = oneshot_count(&q[i], tmp);
+	}
+
+	sf1 = stat_open(statdir, "batch_oneshot");
+	sf2 = stat_open(statdir, "batch_count");
+	for (toprep = 0; toprep < (statdir ? 100 : 1); toprep++) {
+		stopwatch_reset(&sw);
+		stopwatch_start(&sw);
+		for (rep = 0; rep < nrep; rep++) {
+			for (i = 0; i < nq; i++) {
+				int ret = oneshot_count(&q[i], tmp);
+				if (ret != expect[i])
+					printf("test 'batch_oneshot' returns %d != %d\n", ret, expect[i]);
+			}
+		}
+		stopwatch_stop(&sw);
+		stat_report(sf1, "batch_oneshot", &sw);
+
+		stopwatch_reset(&sw);
+		stopwatch_start(&sw);
+		for (rep = 0; rep < nrep; rep++) {
+			if (bmap_inter64_batch_count(q, nq))
+				errx(1, "bmap_inter64_batch_count");
+			for (i = 0; i < nq; i++) {
+				if (q[i].count != expect[i])
+					printf("test 'batch_count' returns %d != %d\n", q[i].count, expect[i]);
+			}
+		}
+		stopwatch_stop(&sw);
+		stat_report(sf2, "batch_count", &sw);
+	}
+	if (statdir) {
+		fclose(sf1);
+		fclose(sf2);
+	}
+	free(tmp->bits);
+	free(tmp);
+}
+
+static int
+ref_bit(struct bmap *b, int i)
+{
+	uint64_t *d = b->bits;
+
+	return (d[i / 64] >> (i % 64)) & 1;
+}
+
+static int
+ref_inter_count_range(struct bmap *r, struct bmap *s, int lo, int hi)
+{
+	int nbits = 0;
+	int i;
+
+	for (i = lo; i < hi; i++)
+		nbits += ref_bit(r, i) & ref_bit(s, i);
+	return nbits;
+}
+
+/*
+ * Check the range functions against doing it bit by bit. Edge cases
+ * first (empty, within one word, word boundaries, everything), then
+ * random ranges.
+ */
+static void
+check_range(void)
+{
+	static const int edges[][2] = {
+		{ 0, 0 }, { 17, 17 }, { NBITS, NBITS }, { 3, 17 }, { 0, 64 }, { 63, 65 },
+		{ 64, 128 }, { 64, 129 }, { 1, 255 }, { 0, NBITS }, { NBITS - 1, NBITS },
+	};
+	const int nedges = sizeof(edges) / sizeof(edges[0]);
+	struct bmap *r, *s, *c;
+	int t, i, lo, hi, ret, e;
+
+	c = bmap_alloc();
+	for (t = 0; t < nedges + 500; t++) {
+		if (t < nedges) {
+			lo = edges[t][0];
+			hi = edges[t][1];
+		} else {
+			lo = random() % (NBITS + 1);
+			hi = lo + random() % (t % 2 ? 300 : NBITS + 1 - lo);
+			if (hi > NBITS)
+				hi = NBITS;
+		}
+		r = alloc_density(1);
+		s = alloc_density(1);
+
+		e = 0;
+		for (i = lo; i < hi; i++)
+			e += ref_bit(r, i);
+		if ((ret = bmap_count_range(r, lo, hi)) != e)
+			printf("bmap_count_range(%d, %d) returns %d != %d\n", lo, hi, ret, e);
+
+		memcpy(c->bits, r->bits, NBITS / CHAR_BIT);
+		e = ref_inter_count_range(r, s, lo, hi);
+		if ((ret = bmap_inter_count_range(r, s, lo, hi)) != e)
+			printf("bmap_inter_count_range(%d, %d) returns %d != %d\n", lo, hi, ret, e);
+		for (i = 0; i < NBITS; i++) {
+			int x = i >= lo && i < hi ? ref_bit(c, i) & ref_bit(s, i) : ref_bit(c, i);
+			if (ref_bit(r, i) != x) {
+				printf("bmap_inter_count_range(%d, %d) wrong bit %d\n", lo, hi, i);
+				break;
+			}
+		}
+
+		memcpy(c->bits, r->bits, NBITS / CHAR_BIT);
+		bmap_set_range(r, lo, hi);
+		for (i = 0; i < NBITS; i++) {
+			if (ref_bit(r, i) != (i >= lo && i < hi ? 1 : ref_bit(c, i))) {
+				printf("bmap_set_range(%d, %d) wrong bit %d\n", lo, hi, i);
+				break;
+			}
+		}
+
+		memcpy(c->bits, s->bits, NBITS / CHAR_BIT);
+		bmap_clear_range(s, lo, hi);
+		for (i = 0; i < NBITS; i++) {
+			if (ref_bit(s, i) != (i >= lo && i < hi ? 0 : ref_bit(c, i))) {
+				printf("bmap_clear_range(%d, %d) wrong bit %d\n", lo, hi, i);
+				break;
+			}
+		}
+
+		free(r->bits);
+		free(r);
+		free(s->bits);
+		free(s);
+	}
+	free(c->bits);
+	free(c);
+}
+
+/*
+ * Windowed queries. Intersect 1/16th of the bitmap with the range functions
+ * and compare with doing the full bitmap with the same vector code.
+ */
+static void
+test_range(const char *statdir)
+{
+	const int nbmaps = 8192;
+	const int lo = NBITS / 4, hi = lo + NBITS / 16;
+	int nrep = 80;
+	struct stopwatch sw;
+	struct bmap *bmaps[nbmaps];
+	int expect[nbmaps];
+	FILE *sf1, *sf2;
+	int toprep, rep;
+	int i;
+
+	check_range();
+
+	for (i = 0; i < nbmaps; i++) {
+		bmaps[i] = bmap_alloc_rnd();
+		bmap_set_range(bmaps[i], random() % NBITS, random() % NBITS);
+	}
+	for (i = 0; i < nbmaps; i += 2)
+		expect[i] = ref_inter_count_range(bmaps[i], bmaps[i + 1], lo, hi);
+
+	sf1 = stat_open(statdir, "range_full");
+	sf2 = stat_open(statdir, "range_window");
+	for (toprep = 0; toprep < (statdir ? 100 : 1); toprep++) {
+		stopwatch_reset(&sw);
+		stopwatch_start(&sw);
+		for (rep = 0; rep < nrep; rep++)
+			for (i = 0; i < nbmaps; i += 2)
+#ifdef __AVX__
+				bmap_inter64_avx_u_count_laterstore(bmaps[i], bmaps[i + 1]);
+#else
+				bmap_inter64_count(bmaps[i], bmaps[i + 1]);
+#endif
+		stopwatch_stop(&sw);
+		stat_report(sf1, "range_full", &sw);
+
+		stopwatch_reset(&sw);
+		stopwatch_start(&sw);
+		for (rep = 0; rep < nrep; rep++) {
+			for (i = 0; i < nbmaps; i += 2) {
+				int ret = bmap_inter_count_range(bmaps[i], bmaps[i + 1], lo, hi);
+				if (ret != expect[i])
+					printf("test 'range_window' returns %d != %d\n", ret, expect[i]);
+			}
+		}
+		stopwatch_stop(&sw);
+		stat_report(sf2, "range_window", &sw);
+	}
+	if (statdir) {
+		fclose(sf1);
+		fclose(sf2);
+	}
+}
+
+static void
+free_bmap(struct bmap *b)
+{
+	free(b->bits);
+	free(b);
+}
+
+/*
+ * Random bitmap with a mix of clean and literal words so that the
+ * compressed streams have runs and literals in different places.
+ */
+static struct bmap *
+alloc_runs(void)
+{
+	struct bmap *b = alloc_density(1);
+	uint64_t *d = b->bits;
+	int i, j, n;
+
+	for (i = 0; i < NBITS / (CHAR_BIT * sizeof(*d)); i += n) {
+		n = 1 + random() % 40;
+		for (j = i; j < i + n && j < NBITS / (CHAR_BIT * sizeof(*d)); j++) {
+			switch (random() % 3) {
+			case 0:
+				d[j] = 0;
+				break;
+			case 1:
+				d[j] = ~0ULL;
+				break;
+			}
+		}
+	}
+	return b;
+}
+
+/*
+ * Check the compressed bitmaps against the dense ones: round trips,
+ * counts, both intersections and that broken streams are rejected.
+ */
+static void
+check_ewah(void)
+{
+	struct bmap *r, *s, *x, *tmp;
+	struct bmap_ewah *er, *es, *ei, bad;
+	uint64_t *words;
+	int t, e;
+
+	tmp = bmap_alloc();
+	for (t = 0; t < 300; t++) {
+		r = t % 3 == 0 ? alloc_density(1) : alloc_runs();
+		s = t % 5 == 0 ? alloc_density(1) : alloc_runs();
+		er = bmap_ewah_encode(r);
+		es = bmap_ewah_encode(s);
+
+		x = bmap_ewah_decode(er);
+		if (x == NULL || memcmp(x->bits, r->bits, NBITS / CHAR_BIT))
+			printf("bmap_ewah_decode(bmap_ewah_encode(b)) != b\n");
+		if (x)
+			free_bmap(x);
+		if (bmap_ewah_count(er) != bmap_count(r))
+			printf("bmap_ewah_count returns %d != %d\n", bmap_ewah_count(er), bmap_count(r));
+
+		e = bmap_inter64_count_nostore(r, s);
+		if (bmap_ewah_inter_count(er, es) != e)
+			printf("bmap_ewah_inter_count returns %d != %d\n", bmap_ewah_inter_count(er, es), e);
+
+		memcpy(tmp->bits, r->bits, NBITS / CHAR_BIT);
+		bmap_inter64_count(tmp, s);
+		ei = bmap_ewah_inter(er, es);
+		x = ei ? bmap_ewah_decode(ei) : NULL;
+		if (x == NULL || memcmp(x->bits, tmp->bits, NBITS / CHAR_BIT))
+			printf("bmap_ewah_decode(bmap_ewah_inter(r, s)) != r & s\n");
+		if (x)
+			free_bmap(x);
+		bmap_ewah_free(ei);
+
+		bmap_ewah_free(er);
+		bmap_ewah_free(es);
+		free_bmap(r);
+		free_bmap(s);
+	}
+
+	/* Truncated stream. */
+	r = alloc_runs();
+	er = bmap_ewah_encode(r);
+	er->nwords--;
+	if ((x = bmap_ewah_decode(er)) != NULL || bmap_ewah_count(er) != -1 ||
+	    bmap_ewah_inter_count(er, er) != -1 || bmap_ewah_inter(er, er) != NULL)
+		printf("truncated ewah stream accepted\n");
+	er->nwords++;
+	bmap_ewah_free(er);
+	free_bmap(r);
+
+	/* A run that's far longer than the bitmap and literals past the end. */
+	words = calloc(4, sizeof(*words));
+	bad.words = words;
+	bad.nwords = bad.size = 4;
+	words[0] = 1 | ((1ULL << 32) - 1) << 1;
+	if (bmap_ewah_decode(&bad) != NULL || bmap_ewah_count(&bad) != -1)
+		printf("ewah stream with too long run accepted\n");
+	words[0] = (uint64_t)1000 << 33;
+	if (bmap_ewah_decode(&bad) != NULL || bmap_ewah_count(&bad) != -1)
+		printf("ewah stream with literals past the end accepted\n");
+	free(words);
+
+	/*
+	 * Trailing words after a stream that's already complete, in both
+	 * operand positions since the walk stops when either one runs out.
+	 */
+	r = bmap_alloc();
+	bmap_set_range(r, 0, NBITS);
+	er = bmap_ewah_encode(r);
+	words = calloc(er->nwords + 2, sizeof(*words));
+	memcpy(words, er->words, er->nwords * sizeof(*words));
+	words[er->nwords] = (uint64_t)1 << 33;
+	words[er->nwords + 1] = ~0ULL;
+	bad.words = words;
+	bad.nwords = bad.size = er->nwords + 2;
+	if ((x = bmap_ewah_decode(&bad)) != NULL || bmap_ewah_count(&bad) != -1 ||
+	    bmap_ewah_inter_count(er, &bad) != -1 || bmap_ewah_inter_count(&bad, er) != -1 ||
+	    (ei = bmap_ewah_inter(er, &bad)) != NULL || (ei = bmap_ewah_inter(&bad, er)) != NULL)
+		printf("ewah stream with trailing words accepted\n");
+	free(words);
+	bmap_ewah_free(er);
+	free_bmap(r);
+	free_bmap(tmp);
+}
+
+/*
+ * Compressed bitmaps with long runs. Compare the dense intersection with
+ * decompressing first and with walking the compressed streams directly.
+ */
+static void
+test_ewah(const char *statdir)
+{
+	const int nbmaps = 8192;
+	int nrep = 20;
+	struct stopwatch sw;
+	struct bmap *bmaps[nbmaps];
+	struct bmap_ewah *ewah[nbmaps];
+	int expect[nbmaps];
+	FILE *sf1, *sf2, *sf3;
+	long nwords = 0;
+	int toprep, rep;
+	int i;
+
+	check_ewah();
+
+	for (i = 0; i < nbmaps; i++) {
+		bmaps[i] = bmap_alloc_rnd();
+		bmap_set_range(bmaps[i], random() % NBITS, random() % NBITS);
+		ewah[i] = bmap_ewah_encode(bmaps[i]);
+		nwords += ewah[i]->nwords;
+	}
+	for (i = 0; i < nbmaps; i += 2)
+		expect[i] = bmap_inter64_count_nostore(bmaps[i], bmaps[i + 1]);
+	printf("ewah_size: %f\n", (double)nwords * 64 / nbmaps / NBITS);
+
+	sf1 = stat_open(statdir, "ewah_dense");
+	sf2 = stat_open(statdir, "ewah_decode");
+	sf3 = stat_open(statdir, "ewah_inter_count");
+	for (toprep = 0; toprep < (statdir ? 100 : 1); toprep++) {
+		stopwatch_reset(&sw);
+		stopwatch_start(&sw);
+		for (rep = 0; rep < nrep; rep++)
+			for (i = 0; i < nbmaps; i += 2)
+				bmap_inter64_count_nostore(bmaps[i], bmaps[i + 1]);
+		stopwatch_stop(&sw);
+		stat_report(sf1, "ewah_dense", &sw);
+
+		stopwatch_reset(&sw);
+		stopwatch_start(&sw);
+		for (rep = 0; rep < nrep; rep++) {
+			for (i = 0; i < nbmaps; i += 2) {
+				struct bmap *r = bmap_ewah_decode(ewah[i]);
+				struct bmap *s = bmap_ewah_decode(ewah[i + 1]);
+				int ret = bmap_inter64_count(r, s);
+				if (ret != expect[i])
+					printf("test 'ewah_decode' returns %d != %d\n", ret, expect[i]);
+				free(r->bits);
+				free(r);
+				free(s->bits);
+				free(s);
+			}
+		}
+		stopwatch_stop(&sw);
+		stat_report(sf2, "ewah_decode", &sw);
+
+		stopwatch_reset(&sw);
+		stopwatch_start(&sw);
+		for (rep = 0; rep < nrep; rep++) {
+			for (i = 0; i < nbmaps; i += 2) {
+				int ret = bmap_ewah_inter_count(ewah[i], ewah[i + 1]);
+				if (ret != expect[i])
+					printf("test 'ewah_inter_count' returns %d != %d\n", ret, expect[i]);
+			}
+		}
+		stopwatch_stop(&sw);
+		stat_report(sf3, "ewah_inter_count", &sw);
+	}
+	if (statdir) {
+		fclose(sf1);
+		fclose(sf2);
+		fclose(sf3);
+	}
+}
+
+/*
+ * Bitmaps loaded from a file into a cache that's much smaller than the
+ * file. Compare waiting for every read with issuing the reads for the
+ * next query while the current one is computed.
+ */
+static void
+test_loader(const char *statdir)
+{
+	const int nbmaps = 8192;
+	const int nq = 4096;
+	const int ncache = 256;
+	int nrep = 4;
+	struct stopwatch sw;
+	struct bmap *bmaps[nbmaps];
+	int ids[nq * 2];
+	int expect[nq];
+	int counts[nq];
+	int small_ids[64];
+	char path[] = "/tmp/bmap_loader.XXXXXX";
+	int toprep, rep;
+	int fd, i, f;
+
+	for (i = 0; i < nbmaps; i++)
+		bmaps[i] = alloc_density(1);
+	for (i = 0; i < nq; i++) {
+		ids[2 * i] = random() % nbmaps;
+		ids[2 * i + 1] = random() % nbmaps;
+		expect[i] = bmap_inter64_count_nostore(bmaps[ids[2 * i]], bmaps[ids[2 * i + 1]]);
+	}
+	if ((fd = mkstemp(path)) == -1)
+		err(1, "mkstemp");
+	close(fd);
+	if (bmap_loader_write(path, bmaps, nbmaps))
+		err(1, "bmap_loader_write");
+
+	for (f = 0; f < 2; f++) {
+		struct bmap_loader *l;
+		char n1[64], n2[64];
+		FILE *sf1, *sf2;
+
+		if ((l = bmap_loader_open(path, ncache, f ? BMAP_LOADER_NOURING : 0)) == NULL)
+			err(1, "bmap_loader_open");
+		snprintf(n1, sizeof(n1), "loader_%s_sync", bmap_loader_backend(l));
+		snprintf(n2, sizeof(n2), "loader_%s_pipelined", bmap_loader_backend(l));
+		sf1 = stat_open(statdir, n1);
+		sf2 = stat_open(statdir, n2);
+		for (toprep = 0; toprep < (statdir ? 100 : 1); toprep++) {
+			stopwatch_reset(&sw);
+			stopwatch_start(&sw);
+			for (rep = 0; rep < nrep; rep++) {
+				for (i = 0; i < nq; i++) {
+					struct bmap *r = bmap_loader_get(l, ids[2 * i]);
+					struct bmap *s = bmap_loader_get(l, ids[2 * i + 1]);
+					int ret;
+
+					if (r == NULL || s == NULL)
+						errx(1, "bmap_loader_get");
+					ret = bmap_inter64_count_nostore(r, s);
+					if (ret != expect[i])
+						printf("test '%s' returns %d != %d\n", n1, ret, expect[i]);
+					bmap_loader_put(l, ids[2 * i]);
+					bmap_loader_put(l, ids[2 * i + 1]);
+				}
+			}
+			stopwatch_stop(&sw);
+			stat_report(sf1, n1, &sw);
+
+			stopwatch_reset(&sw);
+			stopwatch_start(&sw);
+			for (rep = 0; rep < nrep; rep++) {
+				if (bmap_loader_inter_count(l, ids, counts, nq))
+					errx(1, "bmap_loader_inter_count");
+				for (i = 0; i < nq; i++) {
+					if (counts[i] != expect[i])
+						printf("test '%s' returns %d != %d\n", n2, counts[i], expect[i]);
+				}
+			}
+			stopwatch_stop(&sw);
+			stat_report(sf2, n2, &sw);
+		}
+		if (statdir) {
+			fclose(sf1);
+			fclose(sf2);
+		}
+		bmap_loader_close(l);
+
+		/*
+		 * With a cache that only fits the current and the next
+		 * query every bitmap must still be read exactly once, the
+		 * prefetch must not evict the pair being intersected.
+		 */
+		if ((l = bmap_loader_open(path, 4, f ? BMAP_LOADER_NOURING : 0)) == NULL)
+			err(1, "bmap_loader_open");
+		for (i = 0; i < 32; i++) {
+			small_ids[2 * i] = 2 * i;
+			small_ids[2 * i + 1] = 2 * i + 1;
+		}
+		if (bmap_loader_inter_count(l, small_ids, counts, 32))
+			errx(1, "bmap_loader_inter_count");
+		for (i = 0; i < 32; i++) {
+			int ex = bmap_inter64_count_nostore(bmaps[2 * i], bmaps[2 * i + 1]);
+			if (counts[i] != ex)
+				printf("test 'loader_%s_small' returns %d != %d\n", bmap_loader_backend(l), counts[i], ex);
+		}
+		if (bmap_loader_nreads(l) != 64)
+			printf("test 'loader_%s_small' reads %lu != 64\n", bmap_loader_backend(l), bmap_loader_nreads(l));
+		bmap_loader_close(l);
+	}
+	unlink(path);
+	for (i = 0; i < nbmaps; i++)
+		free_bmap(bmaps[i]);
+}
+
+/*
+ * Speed and accuracy of the estimated intersection count against the
+ * exact count for a few densities. The last two cases are a sparse pair
+ * and a clustered pair, both operands dense in the same few 512 bit
+ * blocks and empty everywhere else, where most samples see nothing. The
+ * bounds only hold when the bits are spread out, so the coverage of the
+ * clustered pair is reported, not checked.
+ */
+static void
+test_estimate(const char *statdir)
+{
+	const int nbmaps = 1024;
+	const double err = 0.01, confidence = 0.95;
+	int nrep = 80;
+	struct stopwatch sw;
+	struct bmap *bmaps[nbmaps];
+	int expect[nbmaps];
+	uint32_t seed = 1;
+	int k, i, j;
+
+	/* Empty and full intersections must be cheaper than counting. */
+	for (k = 0; k < 2; k++) {
+		struct bmap_estimate est;
+		struct bmap *r = bmap_alloc();
+		int e;
+
+		if (k)
+			bmap_set_range(r, 0, NBITS);
+		e = bmap_count(r);
+		est = bmap_inter_count_estimate(r, r, err, confidence, &seed);
+		if (est.sampled >= NBITS / 64 || est.lo > e || est.hi < e)
+			printf("test 'estimate_%s' returns [%d, %d] sampled %d, real %d\n", k ? "full" : "empty",
+			    est.lo, est.hi, est.sampled, e);
+		free_bmap(r);
+	}
+
+	for (k = 1; k <= 6; k++) {
+		struct bmap_estimate est;
+		char name[16], n1[64], n2[64];
+		FILE *sf1, *sf2;
+		double abserr = 0;
+		long sampled = 0;
+		int covered = 0;
+		int toprep, rep;
+
+		if (k <= 4) {
+			/* Both operands at density 1/2^k. */
+			snprintf(name, sizeof(name), "d%d", k);
+			for (i = 0; i < nbmaps; i++)
+				bmaps[i] = alloc_density(k);
+		} else if (k == 5) {
+			snprintf(name, sizeof(name), "sparse");
+			for (i = 0; i < nbmaps; i++)
+				bmaps[i] = alloc_density(6);
+		} else {
+			snprintf(name, sizeof(name), "clustered");
+			for (i = 0; i < nbmaps; i += 2) {
+				bmaps[i] = alloc_density(1);
+				bmaps[i + 1] = alloc_density(1);
+				for (j = 0; j < NBITS; j += 512) {
+					if (random() % 32 == 0)
+						continue;
+					bmap_clear_range(bmaps[i], j, j + 512);
+					bmap_clear_range(bmaps[i + 1], j, j + 512);
+				}
+			}
+		}
+		/* Every pair a few times, otherwise the coverage is too noisy to check. */
+		for (i = 0; i < nbmaps; i += 2) {
+			expect[i] = bmap_inter64_count_nostore(bmaps[i], bmaps[i + 1]);
+			for (j = 0; j < 8; j++) {
+				est = bmap_inter_count_estimate(bmaps[i], bmaps[i + 1], err, confidence, &seed);
+				abserr += abs(est.count - expect[i]);
+				sampled += est.sampled;
+				covered += est.lo <= expect[i] && expect[i] <= est.hi;
+			}
+		}
+		printf("estimate_%s: error %f%% sampled %f%% covered %f%%\n", name,
+		    100.0 * abserr / (nbmaps * 4) / NBITS,
+		    100.0 * sampled * 64 / (nbmaps * 4) / NBITS,
+		    100.0 * covered / (nbmaps * 4));
+		if (k <= 5 && covered < nbmaps * 4 * confidence)
+			printf("test 'estimate_%s' covered %d < %d\n", name, covered, (int)(nbmaps * 4 * confidence));
+
+		snprintf(n1, sizeof(n1), "estimate_%s_exact", name);
+		snprintf(n2, sizeof(n2), "estimate_%s_estimate", name);
+		sf1 = stat_open(statdir, n1);
+		sf2 = stat_open(statdir, n2);
+		for (toprep = 0; toprep < (statdir ? 100 : 1); toprep++) {
+			stopwatch_reset(&sw);
+			stopwatch_start(&sw);
+			for (rep = 0; rep < nrep; rep++)
+				for (i = 0; i < nbmaps; i += 2)
+					bmap_inter64_count_nostore(bmaps[i], bmaps[i + 1]);
+			stopwatch_stop(&sw);
+			stat_report(sf1, n1, &sw);
+
+			stopwatch_reset(&sw);
+			stopwatch_start(&sw);
+			for (rep = 0; rep < nrep; rep++)
+				for (i = 0; i < nbmaps; i += 2)
+					bmap_inter_count_estimate(bmaps[i], bmaps[i + 1], err, confidence, &seed);
+			stopwatch_stop(&sw);
+			stat_report(sf2, n2, &sw);
+		}
+		if (statdir) {
+			fclose(sf1);
+			fclose(sf2);
+		}
+		for (i = 0; i < nbmaps; i++) {
+			free(bmaps[i]->bits);
+			free(bmaps[i]);
+		}
+	}
+}
+
 int
 main(int argc, char **argv)
 {
@@ -117,5 +861,11 @@ main(int argc, char **argv)
 			fclose(statfile);
 	}
 
+	test_batch(statdir);
+	test_range(statdir);
+	test_ewah(statdir);
+	test_loader(statdir);
+	test_estimate(statdir);
+
 	return 0;
 }